@@ -23,32 +23,325 @@
 #include "lerc_util.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <float.h>
+
+#include <algorithm>
+#include <limits>
 
 #include "tiffio.h"
 
+#include "parallel.h"
+
 #include "Lerc.h"
 
 using std::vector;
 
 NS_GAGO_BEGIN
 
-////////////////////////////////////////////////////////////////////////////////
-// Lerc, public:
+// Lerc2 v3 is written by all encode paths
+static const int kLercCodecVersion = 3;
 
-// Tiff --------------------------------------------------------
+// micro block sizes tried by the target size search, Lerc2 itself only tries 8 and 16
+static const int kMicroBlockSizes[] = { 8, 16, 32 };
 
-bool LercUtil::ReadTiffOrDie(const std::string& path_to_file, uint32_t* img_width,
-                             uint32_t* img_height, uint32_t* img_dims, DataType* data_type,
-                             std::vector<unsigned char>* raw_data) {
-  TIFF* tif = TIFFOpen(path_to_file.c_str(), "r");
-  if (tif == nullptr) {
-    Logger::LogD("ERROR when TIFFOpen %s\n", path_to_file.c_str());
+// the search encodes a grid of at most kMaxSampleWindows x kMaxSampleWindows windows,
+// window size is a multiple of every micro block size so blocks are not cut
+static const uint32_t kSampleWindowSize = 64;
+static const uint32_t kMaxSampleWindows = 8;
+
+// ratio between two neighbouring max Z error candidates
+static const double kMaxZErrorStep = 1.41421356;
+
+// full raster passes spent narrowing the error between two candidates once the ladder is searched
+static const int kMaxBisectPasses = 4;
+
+// Lerc2 checksum covers the blob after "Lerc2 ", version and the checksum itself
+static const int kLerc2ChecksumOffset = 6 + sizeof(int) + sizeof(unsigned int);
+
+static size_t SizeOfDataType(LercUtil::DataType data_type) {
+  switch (data_type) {
+    case LercUtil::DataType::CHAR:   return sizeof(int8_t);
+    case LercUtil::DataType::BYTE:   return sizeof(uint8_t);
+    case LercUtil::DataType::SHORT:  return sizeof(int16_t);
+    case LercUtil::DataType::USHORT: return sizeof(uint16_t);
+    case LercUtil::DataType::INT:    return sizeof(int32_t);
+    case LercUtil::DataType::UINT:   return sizeof(uint32_t);
+    case LercUtil::DataType::FLOAT:  return sizeof(float);
+    case LercUtil::DataType::DOUBLE: return sizeof(double);
+    default:                         return 0;
+  }
+}
+
+static bool IsIntegerDataType(LercUtil::DataType data_type) {
+  return data_type != LercUtil::DataType::FLOAT && data_type != LercUtil::DataType::DOUBLE;
+}
+
+template<typename T>
+static void ComputeZRangeTempl(const T* data, size_t count, double* z_min, double* z_max) {
+  double lo = std::numeric_limits<double>::infinity();
+  double hi = -std::numeric_limits<double>::infinity();
+  for (size_t i = 0; i < count; ++i) {
+    double z = static_cast<double>(data[i]);
+    if (z < lo) lo = z; // NaN never compares
+    if (z > hi) hi = z;
+  }
+  *z_min = lo;
+  *z_max = hi;
+}
+
+static bool ComputeZRange(const vector<unsigned char>& raw_data, LercUtil::DataType data_type,
+                          double* z_min, double* z_max) {
+  size_t count = raw_data.size() / SizeOfDataType(data_type);
+  const void* data = &raw_data[0];
+  
+  switch (data_type) {
+    case LercUtil::DataType::CHAR:   ComputeZRangeTempl(static_cast<const int8_t*>(data), count, z_min, z_max); break;
+    case LercUtil::DataType::BYTE:   ComputeZRangeTempl(static_cast<const uint8_t*>(data), count, z_min, z_max); break;
+    case LercUtil::DataType::SHORT:  ComputeZRangeTempl(static_cast<const int16_t*>(data), count, z_min, z_max); break;
+    case LercUtil::DataType::USHORT: ComputeZRangeTempl(static_cast<const uint16_t*>(data), count, z_min, z_max); break;
+    case LercUtil::DataType::INT:    ComputeZRangeTempl(static_cast<const int32_t*>(data), count, z_min, z_max); break;
+    case LercUtil::DataType::UINT:   ComputeZRangeTempl(static_cast<const uint32_t*>(data), count, z_min, z_max); break;
+    case LercUtil::DataType::FLOAT:  ComputeZRangeTempl(static_cast<const float*>(data), count, z_min, z_max); break;
+    case LercUtil::DataType::DOUBLE: ComputeZRangeTempl(static_cast<const double*>(data), count, z_min, z_max); break;
+    default: return false;
+  }
+  
+  return *z_min <= *z_max;
+}
+
+// Geometric ladder of max Z errors from the finest allowed one up to half the data range.
+// Lerc floors integer errors and never goes below 0.5, so the ladder does the same.
+static vector<double> MaxZErrorCandidates(LercUtil::DataType data_type, double z_range,
+                                          double min_z_error) {
+  bool is_integer = IsIntegerDataType(data_type);
+  double lo = std::max(min_z_error, is_integer ? 0.5 : z_range / (1 << 20));
+  double hi = std::max(lo, z_range / 2);
+  
+  vector<double> candidates;
+  if (lo <= 0 || hi <= lo) {
+    candidates.push_back(is_integer ? std::max(0.5, floor(lo)) : std::max(0.0, lo));
+    return candidates;
+  }
+  
+  for (double e = lo; ; e *= kMaxZErrorStep) {
+    double z_error = is_integer ? std::max(0.5, floor(e)) : e;
+    if (candidates.empty() || z_error > candidates.back()) {
+      candidates.push_back(z_error);
+    }
+    if (e >= hi) break;
+  }
+  return candidates;
+}
+
+// Copies evenly spaced windows of every band into a smaller mosaic. Returns false if the
+// raster is too small for a subsample to pay off, in which case the full raster is used.
+static bool SampleWindows(const vector<unsigned char>& raw_data, uint32_t width, uint32_t height,
+                          uint16_t band, size_t type_size, vector<unsigned char>* sample,
+                          uint32_t* sample_width, uint32_t* sample_height) {
+  uint32_t nx = std::min(kMaxSampleWindows, width / kSampleWindowSize);
+  uint32_t ny = std::min(kMaxSampleWindows, height / kSampleWindowSize);
+  
+  uint64_t num_sample_pixels = static_cast<uint64_t>(nx * kSampleWindowSize) * ny * kSampleWindowSize;
+  if (num_sample_pixels == 0 || num_sample_pixels * 2 > static_cast<uint64_t>(width) * height) {
+    return false;
+  }
+  
+  uint32_t sw = nx * kSampleWindowSize;
+  uint32_t sh = ny * kSampleWindowSize;
+  size_t window_line_size = kSampleWindowSize * type_size;
+  
+  sample->resize(static_cast<size_t>(sw) * sh * band * type_size);
+  unsigned char* dst = &(*sample)[0];
+  
+  for (uint16_t b = 0; b < band; ++b) {
+    const unsigned char* src_band = &raw_data[0] + static_cast<size_t>(width) * height * type_size * b;
+    for (uint32_t j = 0; j < ny; ++j) {
+      uint32_t y0 = (2 * j + 1) * height / (2 * ny) - kSampleWindowSize / 2;
+      for (uint32_t row = 0; row < kSampleWindowSize; ++row) {
+        const unsigned char* src_line = src_band + (static_cast<size_t>(y0 + row) * width) * type_size;
+        for (uint32_t i = 0; i < nx; ++i) {
+          uint32_t x0 = (2 * i + 1) * width / (2 * nx) - kSampleWindowSize / 2;
+          memcpy(dst, src_line + x0 * type_size, window_line_size);
+          dst += window_line_size;
+        }
+      }
+    }
+  }
+  
+  *sample_width = sw;
+  *sample_height = sh;
+  return true;
+}
+
+template<typename T>
+static double MaxAbsErrorTempl(const T* a, const T* b, size_t count) {
+  double max_error = 0;
+  for (size_t i = 0; i < count; ++i) {
+    double za = static_cast<double>(a[i]);
+    double zb = static_cast<double>(b[i]);
+    if (za == zb || (za != za && zb != zb)) continue; // equal or both NaN
+    double error = fabs(za - zb);
+    if (!(error <= max_error)) max_error = error; // NaN on one side only counts as infinite
+  }
+  return max_error;
+}
+
+static double MaxAbsError(const void* pa, const void* pb, size_t num_bytes, LercUtil::DataType data_type) {
+  size_t count = num_bytes / SizeOfDataType(data_type);
+  
+  switch (data_type) {
+    case LercUtil::DataType::CHAR:   return MaxAbsErrorTempl(static_cast<const int8_t*>(pa), static_cast<const int8_t*>(pb), count);
+    case LercUtil::DataType::BYTE:   return MaxAbsErrorTempl(static_cast<const uint8_t*>(pa), static_cast<const uint8_t*>(pb), count);
+    case LercUtil::DataType::SHORT:  return MaxAbsErrorTempl(static_cast<const int16_t*>(pa), static_cast<const int16_t*>(pb), count);
+    case LercUtil::DataType::USHORT: return MaxAbsErrorTempl(static_cast<const uint16_t*>(pa), static_cast<const uint16_t*>(pb), count);
+    case LercUtil::DataType::INT:    return MaxAbsErrorTempl(static_cast<const int32_t*>(pa), static_cast<const int32_t*>(pb), count);
+    case LercUtil::DataType::UINT:   return MaxAbsErrorTempl(static_cast<const uint32_t*>(pa), static_cast<const uint32_t*>(pb), count);
+    case LercUtil::DataType::FLOAT:  return MaxAbsErrorTempl(static_cast<const float*>(pa), static_cast<const float*>(pb), count);
+    case LercUtil::DataType::DOUBLE: return MaxAbsErrorTempl(static_cast<const double*>(pa), static_cast<const double*>(pb), count);
+    default:                         return std::numeric_limits<double>::infinity();
+  }
+}
+
+static bool FileExists(const std::string& path) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  fclose(file);
+  return true;
+}
+
+static bool ReadFileOrDie(const std::string& path, vector<unsigned char>* data) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    Logger::LogD("ERROR when fopen %s", path.c_str());
     return false;
   }
   
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  
+  data->resize(size > 0 ? size : 0);
+  bool success = size > 0 && fread(&(*data)[0], 1, size, file) == static_cast<size_t>(size);
+  fclose(file);
+  
+  if (!success) {
+    Logger::LogD("ERROR when fread %s", path.c_str());
+  }
+  return success;
+}
+
+// Walks the single band Lerc2 blobs and recomputes their checksums.
+static bool CheckLercChecksums(const vector<unsigned char>& blob) {
+  size_t pos = 0;
+  LercNS::Lerc2::HeaderInfo hd;
+  
+  while (pos < blob.size() && LercNS::Lerc2::GetHeaderInfo(&blob[pos], blob.size() - pos, hd)) {
+    if (hd.blobSize < kLerc2ChecksumOffset || static_cast<size_t>(hd.blobSize) > blob.size() - pos) {
+      return false;
+    }
+    if (hd.version >= 3 &&
+        hd.checksum != LercNS::Lerc2::ComputeChecksumFletcher32(&blob[pos] + kLerc2ChecksumOffset,
+                                                                hd.blobSize - kLerc2ChecksumOffset)) {
+      return false;
+    }
+    pos += hd.blobSize;
+  }
+  return pos == blob.size();
+}
+
+// Lerc2 blob sizes are int, a size estimate past that has wrapped somewhere and is not trusted.
+static bool IsLercSizeValid(unsigned int num_bytes) {
+  return num_bytes > 0 && num_bytes <= static_cast<unsigned int>(std::numeric_limits<int>::max());
+}
+
+static bool ComputeLercSize(const void* data, LercUtil::DataType data_type, uint32_t width,
+                            uint32_t height, uint16_t band, double max_z_error, int micro_block_size,
+                            unsigned int* num_bytes_needed) {
+  return LercNS::ErrCode::Ok == LercNS::Lerc::ComputeCompressedSize(data,
+                                                                    kLercCodecVersion,
+                                                                    static_cast<LercNS::Lerc::DataType>(data_type),
+                                                                    1,
+                                                                    width, height, band,
+                                                                    0,
+                                                                    max_z_error,
+                                                                    *num_bytes_needed,
+                                                                    micro_block_size) &&
+      IsLercSizeValid(*num_bytes_needed);
+}
+
+// Encodes raw data with the given setting and writes the blob to output_path,
+// pass num_bytes_needed if it is already known, 0 otherwise.
+static bool EncodeRawDataOrDie(const unsigned char* raw_data, uint32_t width, uint32_t height,
+                               uint16_t band, LercUtil::DataType data_type, double max_z_error,
+                               int micro_block_size, unsigned int num_bytes_needed,
+                               const std::string& output_path) {
+  // TODO(lin.xiaoe.f@gmail.com) replace with real dims
+  int dims = 1;
+  
+  unsigned int num_bytes_written = 0;
+  
+  // convert data type to proper one
+  LercNS::Lerc::DataType lerc_dt = static_cast<LercNS::Lerc::DataType>(data_type);
+  if (lerc_dt == LercNS::Lerc::DataType::DT_Double ||
+      lerc_dt == LercNS::Lerc::DataType::DT_Undefined) {
+    Logger::LogD("ERROR input data type %s\n", output_path.c_str());
+    return false;
+  }
+  
+  if (num_bytes_needed == 0 &&
+      !ComputeLercSize(raw_data,                         // raw image data, row by row, band by band
+                       data_type, width, height, band,
+                       max_z_error,                      // max coding error per pixel, or precision
+                       micro_block_size,
+                       &num_bytes_needed)) {             // size of outgoing Lerc blob
+    Logger::LogD("ERROR when ComputeBufferSize %s\n", output_path.c_str());
+    return false;
+  }
+  
+  vector<LercNS::Byte> lerc_buffer(num_bytes_needed);
+  
+  Logger::LogD("Try to encode dt: %d w: %d h: %d max_z_error %f micro_block_size %d band %d",
+               lerc_dt, width, height, max_z_error, micro_block_size, band);
+  
+  if (LercNS::ErrCode::Ok != LercNS::Lerc::Encode(raw_data,                       // raw image data, row by row, band by band
+                   kLercCodecVersion, lerc_dt, dims,
+                   width, height, band,
+                   0,                      // 0 if all pixels are valid
+                   max_z_error,            // max coding error per pixel, or precision
+                   &lerc_buffer[0],        // buffer to write to, function will fail if buffer too small
+                   num_bytes_needed,       // buffer size
+                   num_bytes_written,      // num bytes written to buffer
+                   micro_block_size)) {
+    Logger::LogD("ERROR when Encode %s\n", output_path.c_str());
+    return false;
+  }
+  
+  // write to file
+  FILE* file = fopen(output_path.c_str(), "wb");
+  if (file == nullptr) {
+    Logger::LogD("ERROR when fopen %s\n", output_path.c_str());
+    return false;
+  }
+  fwrite(&lerc_buffer[0], 1, num_bytes_written, file); // write bytes
+  fclose(file);
+  
+  return true;
+}
+
+// Reads size and data type of an opened TIFF (classic or BigTIFF), path_to_file only names it in logs.
+static bool ReadTiffInfo(TIFF* tif, const std::string& path_to_file, uint32_t* img_width,
+                         uint32_t* img_height, uint32_t* img_dims, uint16_t* img_samples,
+                         LercUtil::DataType* data_type) {
+  typedef LercUtil::DataType DataType;
+  
   uint32_t width = 0;
   uint32_t height = 0;
-  tdata_t buf;
+  uint16_t samples = 1;
   
   uint32_t tiff_dt = 0;
   
@@ -60,6 +353,7 @@ bool LercUtil::ReadTiffOrDie(const std::string& path_to_file, uint32_t* img_widt
   TIFFGetField(tif, TIFFTAG_SAMPLEFORMAT, &tiff_dt);
   TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits_per_sample);
   TIFFGetField(tif, TIFFTAG_XRESOLUTION, &dims);
+  TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
   
   Logger::LogD("TIFF width is %d, height is %d, sampleformat is %d, bitsPerSample is %d, dims is %d", width, height, tiff_dt, bits_per_sample, dims);
   Logger::LogD("is TIFF tiled %d", TIFFIsTiled(tif));
@@ -67,6 +361,7 @@ bool LercUtil::ReadTiffOrDie(const std::string& path_to_file, uint32_t* img_widt
   if (img_width) *img_width = width;
   if (img_height) *img_height = height;
   if (img_dims) *img_dims = dims;
+  if (img_samples) *img_samples = samples;
   
   // Logger::LogD("TIFF sample format is %u, bits per sample is %u", tiff_dt, bits_per_sample);
   
@@ -83,10 +378,19 @@ bool LercUtil::ReadTiffOrDie(const std::string& path_to_file, uint32_t* img_widt
       type_size = sizeof(int32_t);
     } else {
       Logger::LogD("Unknown INT bits per sample %s", path_to_file.c_str());
+      return false;
     }
   } else if (tiff_dt == SAMPLEFORMAT_IEEEFP) {
-    if (data_type) *data_type = DataType::FLOAT;
-    type_size = sizeof(float);
+    if (bits_per_sample == 32) {
+      if (data_type) *data_type = DataType::FLOAT;
+      type_size = sizeof(float);
+    } else if (bits_per_sample == 64) {
+      if (data_type) *data_type = DataType::DOUBLE;
+      type_size = sizeof(double);
+    } else {
+      Logger::LogD("Unknown IEEEFP bits per sample %s", path_to_file.c_str());
+      return false;
+    }
   } else if (tiff_dt == SAMPLEFORMAT_UINT) {
     if (bits_per_sample == 8) {
       if (data_type) *data_type = DataType::BYTE;
@@ -99,32 +403,404 @@ bool LercUtil::ReadTiffOrDie(const std::string& path_to_file, uint32_t* img_widt
       type_size = sizeof(uint32_t);
     } else {
       Logger::LogD("Unknown UINT bits per sample %s", path_to_file.c_str());
+      return false;
     }
   } else {
     Logger::LogD("Unsupported TIFF data format %d, %s", tiff_dt, path_to_file.c_str());
     return false;
   }
   
-  // data
+  return true;
+}
+
+// Reads rows [row0, row0 + num_rows) of an opened TIFF into dst, TIFFScanlineSize() bytes per row.
+// Tiled TIFFs are read a row of tiles at a time, rows are cheapest to read in whole tile rows.
+static bool ReadTiffRows(TIFF* tif, const std::string& path_to_file, uint32_t row0, uint32_t num_rows,
+                         unsigned char* dst) {
+  size_t line_size = TIFFScanlineSize(tif);
+  
+  if (!TIFFIsTiled(tif)) {
+    for (uint32_t row = row0; row < row0 + num_rows; ++row) {
+      if (TIFFReadScanline(tif, dst + line_size * (row - row0), row, 0) < 0) {
+        Logger::LogD("ERROR when TIFFReadScanline %u %s", row, path_to_file.c_str());
+        return false;
+      }
+    }
+    return true;
+  }
+  
+  uint32_t width = 0;
+  uint32_t tile_width = 0;
+  uint32_t tile_length = 0;
+  TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+  TIFFGetField(tif, TIFFTAG_TILEWIDTH, &tile_width);
+  TIFFGetField(tif, TIFFTAG_TILELENGTH, &tile_length);
+  if (width == 0 || tile_width == 0 || tile_length == 0) {
+    Logger::LogD("ERROR invalid tiling %s", path_to_file.c_str());
+    return false;
+  }
+  
+  size_t pixel_size = line_size / width;
+  size_t tile_line_size = tile_width * pixel_size;
+  vector<unsigned char> tile(TIFFTileSize(tif));
+  
+  for (uint32_t ty = row0 - row0 % tile_length; ty < row0 + num_rows; ty += tile_length) {
+    uint32_t y_begin = std::max(ty, row0);
+    uint32_t y_end = std::min(ty + tile_length, row0 + num_rows);
+    
+    for (uint32_t tx = 0; tx < width; tx += tile_width) {
+      if (TIFFReadTile(tif, &tile[0], tx, ty, 0, 0) < 0) {
+        Logger::LogD("ERROR when TIFFReadTile %u %u %s", tx, ty, path_to_file.c_str());
+        return false;
+      }
+      
+      size_t num_bytes = std::min(tile_width, width - tx) * pixel_size;
+      for (uint32_t y = y_begin; y < y_end; ++y) {
+        memcpy(dst + line_size * (y - row0) + tx * pixel_size, &tile[tile_line_size * (y - ty)], num_bytes);
+      }
+    }
+  }
+  
+  return true;
+}
+
+// Reads an opened TIFF, path_to_file only names it in logs. The caller closes tif.
+static bool ReadTiff(TIFF* tif, const std::string& path_to_file, uint32_t* img_width,
+                     uint32_t* img_height, uint32_t* img_dims, uint16_t* img_samples,
+                     LercUtil::DataType* data_type, vector<unsigned char>* raw_data) {
+  uint32_t height = 0;
+  if (!ReadTiffInfo(tif, path_to_file, img_width, &height, img_dims, img_samples, data_type)) {
+    return false;
+  }
+  if (img_height) *img_height = height;
+  
+  // data, rows are read straight into place
   vector<unsigned char>& data = *raw_data;
+  data.resize(static_cast<size_t>(TIFFScanlineSize(tif)) * height);
+  
+  return data.empty() || ReadTiffRows(tif, path_to_file, 0, height, &data[0]);
+}
+
+// Reorders pixel interleaved samples (PLANARCONFIG_CONTIG) into one plane per sample.
+static void DeinterleaveSamples(size_t num_pixels, uint16_t samples, size_t type_size,
+                                vector<unsigned char>* data) {
+  vector<unsigned char> planes(num_pixels * samples * type_size);
+  const unsigned char* src = &(*data)[0];
+  for (uint16_t s = 0; s < samples; ++s) {
+    unsigned char* dst = &planes[s * num_pixels * type_size];
+    for (size_t i = 0; i < num_pixels; ++i) {
+      memcpy(dst + i * type_size, src + (i * samples + s) * type_size, type_size);
+    }
+  }
+  data->swap(planes);
+}
+
+// Reads an opened TIFF into a raster, band by band. The caller closes tif.
+static bool ReadTiffRaster(TIFF* tif, const std::string& path_to_file, LercUtil::Raster* raster) {
+  uint16_t planar_config = PLANARCONFIG_CONTIG;
+  TIFFGetFieldDefaulted(tif, TIFFTAG_PLANARCONFIG, &planar_config);
+  
+  if (!ReadTiff(tif, path_to_file, &raster->width, &raster->height, nullptr, &raster->band,
+                &raster->data_type, &raster->data)) {
+    return false;
+  }
+  
+  if (raster->band > 1) {
+    if (planar_config != PLANARCONFIG_CONTIG) {
+      Logger::LogD("ERROR separate sample planes are not supported %s", path_to_file.c_str());
+      return false;
+    }
+    DeinterleaveSamples(static_cast<size_t>(raster->width) * raster->height, raster->band,
+                        SizeOfDataType(raster->data_type), &raster->data);
+  }
+  return true;
+}
+
+// Reads the Lerc2 header of the first blob in a file, without reading the pixels.
+static bool ReadLercHeader(const std::string& path, LercNS::Lerc2::HeaderInfo* hd) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (file == nullptr) {
+    return false;
+  }
+  
+  unsigned char header[256]; // more than any Lerc2 header up to v4
+  size_t size = fread(header, 1, sizeof(header), file);
+  fclose(file);
+  
+  return LercNS::Lerc2::GetHeaderInfo(header, size, *hd);
+}
+
+// Removes strips StripPath(output_path, first) and on, as long as their headers show they are
+// strips of a raster of this width and data type; anything else is left alone.
+static void RemoveStaleStrips(const std::string& output_path, uint64_t first, uint32_t width,
+                              LercUtil::DataType data_type) {
+  LercNS::Lerc2::HeaderInfo hd;
+  for (uint64_t i = first; ; ++i) {
+    std::string strip_path = LercUtil::StripPath(output_path, i);
+    if (!ReadLercHeader(strip_path, &hd) || hd.nCols != static_cast<int>(width) ||
+        hd.dt != static_cast<LercNS::Lerc2::DataType>(data_type) || remove(strip_path.c_str()) != 0) {
+      return;
+    }
+  }
+}
+
+// Encodes an opened TIFF in strips of whole rows, see LercUtil::EncodeTiffInStripsOrDie.
+static bool EncodeTiffStrips(TIFF* tif, const std::string& path_to_file, const std::string& output_path,
+                             double max_z_error, uint16_t band, uint64_t max_blob_bytes) {
+  uint32_t width = 0;
+  uint32_t height = 0;
+  LercUtil::DataType data_type = LercUtil::DataType::UNKNOWN;
+  if (!ReadTiffInfo(tif, path_to_file, &width, &height, nullptr, nullptr, &data_type)) {
+    return false;
+  }
+  
+  uint64_t line_size = TIFFScanlineSize(tif);
+  uint64_t band_line_size = static_cast<uint64_t>(width) * band * SizeOfDataType(data_type);
+  if (band_line_size == 0 || band_line_size > line_size) {
+    Logger::LogD("ERROR band %d does not match %s", band, path_to_file.c_str());
+    return false;
+  }
+  
+  // whole rows per strip, whole tile rows if tiled so no tile is read twice
+  uint64_t rows_per_strip = std::min(max_blob_bytes, LercUtil::kMaxLercBlobBytes) / line_size;
+  if (rows_per_strip < height && TIFFIsTiled(tif)) {
+    uint32_t tile_length = 0;
+    TIFFGetField(tif, TIFFTAG_TILELENGTH, &tile_length);
+    if (tile_length > 0 && rows_per_strip >= tile_length) { // else tile rows are read in parts
+      rows_per_strip -= rows_per_strip % tile_length;
+    }
+  }
+  rows_per_strip = std::min<uint64_t>(rows_per_strip, height);
+  if (rows_per_strip == 0) {
+    Logger::LogD("ERROR %s can not be split into strips of %llu bytes", path_to_file.c_str(),
+                 static_cast<unsigned long long>(max_blob_bytes));
+    return false;
+  }
+  
+  uint64_t num_strips = (height + rows_per_strip - 1) / rows_per_strip;
+  if (num_strips > 1) {
+    Logger::LogD("Splitting %s into %llu strips of %llu rows", path_to_file.c_str(),
+                 static_cast<unsigned long long>(num_strips), static_cast<unsigned long long>(rows_per_strip));
+    remove(output_path.c_str()); // a stale single blob would shadow the strips on verify
+  }
+  
+  vector<unsigned char> strip(rows_per_strip * line_size);
+  for (uint64_t i = 0; i < num_strips; ++i) {
+    uint32_t row0 = static_cast<uint32_t>(i * rows_per_strip);
+    uint32_t num_rows = static_cast<uint32_t>(std::min<uint64_t>(rows_per_strip, height - row0));
+    
+    std::string strip_path = num_strips == 1 ? output_path : LercUtil::StripPath(output_path, i);
+    if (!ReadTiffRows(tif, path_to_file, row0, num_rows, &strip[0]) ||
+        !EncodeRawDataOrDie(&strip[0], width, num_rows, band, data_type, max_z_error,
+                            kMicroBlockSizes[0], 0, strip_path)) {
+      return false;
+    }
+  }
+  
+  // strips of an earlier encode split more finely, verify would read on into them
+  RemoveStaleStrips(output_path, num_strips > 1 ? num_strips : 0, width, data_type);
+  
+  return true;
+}
+
+// Decodes the LERC strips of an opened TIFF in order and compares them against its rows,
+// see LercUtil::VerifyLercOrDie.
+static bool VerifyLercStrips(TIFF* tif, const std::string& path_to_tiff, const vector<std::string>& lerc_paths,
+                             uint16_t band, LercUtil::VerifyStats* stats) {
+  typedef LercUtil::DataType DataType;
+  
+  uint32_t width = 0;
+  uint32_t height = 0;
+  DataType data_type = DataType::UNKNOWN;
+  if (!ReadTiffInfo(tif, path_to_tiff, &width, &height, nullptr, nullptr, &data_type)) {
+    return false;
+  }
   
   size_t line_size = TIFFScanlineSize(tif);
+  size_t band_line_size = static_cast<size_t>(width) * band * SizeOfDataType(data_type);
+  if (band_line_size == 0 || band_line_size > line_size) {
+    Logger::LogD("ERROR band %d does not match %s", band, path_to_tiff.c_str());
+    return false;
+  }
+  
+  LercUtil::VerifyStats total = { 0, 0, 0, 0, 0 };
+  vector<unsigned char> blob;
+  vector<unsigned char> raw_data;
+  vector<unsigned char> decoded;
+  uint32_t row0 = 0;
   
-  for (int row = 0; row < height; ++row) {
-    buf = _TIFFmalloc(line_size);
-    TIFFReadScanline(tif, buf, row, bits_per_sample);
+  for (const std::string& path_to_lerc : lerc_paths) {
+    if (row0 == height) {
+      Logger::LogD("WARNING %s and on are past the last row of %s, ignored", path_to_lerc.c_str(),
+                   path_to_tiff.c_str());
+      break;
+    }
+    
+    if (!ReadFileOrDie(path_to_lerc, &blob)) {
+      return false;
+    }
+    
+    LercNS::Lerc::LercInfo info;
+    if (blob.size() > static_cast<size_t>(std::numeric_limits<int>::max()) ||
+        LercNS::ErrCode::Ok != LercNS::Lerc::GetLercInfo(&blob[0], static_cast<unsigned int>(blob.size()), info)) {
+      Logger::LogD("ERROR when GetLercInfo %s", path_to_lerc.c_str());
+      return false;
+    }
     
-    data.insert(data.end(), static_cast<unsigned char*>(buf), static_cast<unsigned char*>(buf) + line_size);
+    if (info.nDim != 1 || info.nCols != static_cast<int>(width) || info.nRows <= 0 ||
+        static_cast<uint32_t>(info.nRows) > height - row0 ||
+        info.nBands != band || info.dt != static_cast<LercNS::Lerc::DataType>(data_type)) {
+      Logger::LogD("ERROR %s does not match %s", path_to_lerc.c_str(), path_to_tiff.c_str());
+      return false;
+    }
     
-    _TIFFfree(buf);
+    size_t num_bytes_raw = info.nRows * band_line_size;
+    raw_data.resize(info.nRows * line_size);
+    if (!ReadTiffRows(tif, path_to_tiff, row0, info.nRows, &raw_data[0])) {
+      return false;
+    }
+    
+    decoded.resize(num_bytes_raw);
+    if (LercNS::ErrCode::Ok != LercNS::Lerc::Decode(&blob[0], static_cast<unsigned int>(blob.size()),
+                                                    nullptr,
+                                                    info.nDim, info.nCols, info.nRows, info.nBands,
+                                                    info.dt, &decoded[0])) {
+      if (!CheckLercChecksums(blob)) {
+        Logger::LogD("ERROR checksum mismatch %s", path_to_lerc.c_str());
+      } else {
+        Logger::LogD("ERROR when Decode %s", path_to_lerc.c_str());
+      }
+      return false;
+    }
+    
+    double tolerance = IsIntegerDataType(data_type) ? 0 :
+        std::max(fabs(info.zMin), fabs(info.zMax)) * (data_type == DataType::FLOAT ? FLT_EPSILON : DBL_EPSILON);
+    
+    total.max_error = std::max(total.max_error, MaxAbsError(&raw_data[0], &decoded[0], num_bytes_raw, data_type));
+    total.lerc_max_z_error = std::max(total.lerc_max_z_error, info.maxZError);
+    total.tolerance = std::max(total.tolerance, tolerance);
+    total.num_bytes_lerc += blob.size();
+    total.num_bytes_raw += num_bytes_raw;
+    row0 += info.nRows;
   }
   
-  TIFFClose(tif);
+  if (row0 != height) {
+    Logger::LogD("ERROR %s has %u of %u rows", lerc_paths[0].c_str(), row0, height);
+    return false;
+  }
+  
+  if (stats) {
+    *stats = total;
+  }
   return true;
 }
 
+// Read-only libtiff stream over a caller buffer.
+struct TiffMemoryStream {
+  const unsigned char* data;
+  toff_t size;
+  toff_t offset;
+};
+
+static tmsize_t TiffMemoryRead(thandle_t handle, void* buf, tmsize_t size) {
+  TiffMemoryStream* stream = static_cast<TiffMemoryStream*>(handle);
+  if (size < 0 || stream->offset >= stream->size) {
+    return 0;
+  }
+  tmsize_t n = static_cast<tmsize_t>(std::min<toff_t>(size, stream->size - stream->offset));
+  memcpy(buf, stream->data + stream->offset, n);
+  stream->offset += n;
+  return n;
+}
+
+static tmsize_t TiffMemoryWrite(thandle_t /*handle*/, void* /*buf*/, tmsize_t /*size*/) {
+  return -1;
+}
+
+static toff_t TiffMemorySeek(thandle_t handle, toff_t offset, int whence) {
+  TiffMemoryStream* stream = static_cast<TiffMemoryStream*>(handle);
+  switch (whence) {
+    case SEEK_SET: stream->offset = offset; break;
+    case SEEK_CUR: stream->offset += offset; break;
+    case SEEK_END: stream->offset = stream->size + offset; break;
+    default: return static_cast<toff_t>(-1);
+  }
+  return stream->offset;
+}
+
+static int TiffMemoryClose(thandle_t /*handle*/) {
+  return 0;
+}
+
+static toff_t TiffMemorySize(thandle_t handle) {
+  return static_cast<TiffMemoryStream*>(handle)->size;
+}
+
+// mapping lets libtiff read uncompressed strips from the buffer without copying
+static int TiffMemoryMap(thandle_t handle, void** base, toff_t* size) {
+  TiffMemoryStream* stream = static_cast<TiffMemoryStream*>(handle);
+  *base = const_cast<unsigned char*>(stream->data);
+  *size = stream->size;
+  return 1;
+}
+
+static void TiffMemoryUnmap(thandle_t /*handle*/, void* /*base*/, toff_t /*size*/) {
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Lerc, public:
+
+const uint64_t LercUtil::kMaxLercBlobBytes;
+
+// Tiff --------------------------------------------------------
+
+bool LercUtil::ReadTiffOrDie(const std::string& path_to_file, uint32_t* img_width,
+                             uint32_t* img_height, uint32_t* img_dims, DataType* data_type,
+                             std::vector<unsigned char>* raw_data) {
+  TIFF* tif = TIFFOpen(path_to_file.c_str(), "r");
+  if (tif == nullptr) {
+    Logger::LogD("ERROR when TIFFOpen %s\n", path_to_file.c_str());
+    return false;
+  }
+  
+  bool success = ReadTiff(tif, path_to_file, img_width, img_height, img_dims, nullptr, data_type, raw_data);
+  
+  TIFFClose(tif);
+  return success;
+}
+
+
 bool LercUtil::EncodeTiffOrDie(const std::string& path_to_file, const std::string& output_path,
                                double max_z_error, LercVersion lerc_ver, uint16_t band) {
+  return EncodeTiffInStripsOrDie(path_to_file, output_path, max_z_error, lerc_ver, band, kMaxLercBlobBytes);
+}
+
+bool LercUtil::EncodeTiffInStripsOrDie(const std::string& path_to_file, const std::string& output_path,
+                                       double max_z_error, LercVersion lerc_ver, uint16_t band,
+                                       uint64_t max_blob_bytes) {
+  Logger::LogD("Encoding %s", path_to_file.c_str());
+  
+  TIFF* tif = TIFFOpen(path_to_file.c_str(), "r");
+  if (tif == nullptr) {
+    Logger::LogD("ERROR when TIFFOpen %s\n", path_to_file.c_str());
+    return false;
+  }
+  
+  bool success = EncodeTiffStrips(tif, path_to_file, output_path, max_z_error, band, max_blob_bytes);
+  
+  TIFFClose(tif);
+  return success;
+}
+
+std::string LercUtil::StripPath(const std::string& output_path, size_t index) {
+  return output_path + "." + std::to_string(index);
+}
+
+// Target size --------------------------------------------------------
+
+bool LercUtil::EncodeTiffToTargetSizeOrDie(const std::string& path_to_file, const std::string& output_path,
+                                           size_t target_size, double target_bpp, double min_z_error,
+                                           LercVersion lerc_ver, uint16_t band, bool* target_met_out) {
   Logger::LogD("Encoding %s", path_to_file.c_str());
   
   DataType data_type = DataType::UNKNOWN;
@@ -134,59 +810,442 @@ bool LercUtil::EncodeTiffOrDie(const std::string& path_to_file, const std::strin
   uint32_t height = 0;
   uint32_t dims = 0;
   
-  if (!ReadTiffOrDie(path_to_file, &width, &height, &dims, &data_type, &raw_data)) {
+  TIFF* tif = TIFFOpen(path_to_file.c_str(), "r");
+  if (tif == nullptr) {
+    Logger::LogD("ERROR when TIFFOpen %s\n", path_to_file.c_str());
     return false;
   }
   
-  // TODO(lin.xiaoe.f@gmail.com) replace with real dims
-  dims = 1;
+  // size is checked before any pixel is read, large rasters would be read only to be rejected
+  uint32_t rows = 0;
+  TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &rows);
+  uint64_t num_bytes_raw = static_cast<uint64_t>(TIFFScanlineSize(tif)) * rows;
+  
+  bool success = num_bytes_raw <= kMaxLercBlobBytes &&
+      ReadTiff(tif, path_to_file, &width, &height, &dims, nullptr, &data_type, &raw_data);
+  
+  TIFFClose(tif);
+  
+  if (num_bytes_raw > kMaxLercBlobBytes) {
+    Logger::LogD("ERROR %s is over %llu bytes, target size only encodes single blobs", path_to_file.c_str(),
+                 static_cast<unsigned long long>(kMaxLercBlobBytes));
+    return false;
+  }
+  if (!success) {
+    return false;
+  }
   
-  // compress float buffer to lerc
+  if (target_size == 0) {
+    target_size = static_cast<size_t>(target_bpp * width * height * band / 8);
+  }
+  
+  double max_z_error = min_z_error;
+  int micro_block_size = kMicroBlockSizes[0];
   unsigned int num_bytes_needed = 0;
-  unsigned int num_bytes_written = 0;
-  LercNS::Lerc lerc;
+  bool target_met = false;
   
-  // convert data type to proper one
-  LercNS::Lerc::DataType lerc_dt = static_cast<LercNS::Lerc::DataType>(data_type);
-  if (lerc_dt == LercNS::Lerc::DataType::DT_Double ||
-      lerc_dt == LercNS::Lerc::DataType::DT_Undefined) {
-    Logger::LogD("ERROR input data type %s\n", path_to_file.c_str());
+  if (!SearchEncodeParamsOrDie(raw_data, width, height, band, data_type, target_size, min_z_error,
+                               &max_z_error, &micro_block_size, &num_bytes_needed, &target_met)) {
+    Logger::LogD("ERROR when SearchEncodeParams %s\n", path_to_file.c_str());
     return false;
   }
   
-  if (LercNS::ErrCode::Ok != LercNS::Lerc::ComputeCompressedSize((void*)&raw_data[0],                   // raw image data, row by row, band by band
-                              3, lerc_dt, dims,
-                              width, height, band,
-                              0,                             // set 0 if all pixels are valid
-                              max_z_error,                   // max coding error per pixel, or precision
-                              num_bytes_needed)) {           // size of outgoing Lerc blob
-    Logger::LogD("ERROR when ComputeBufferSize %s\n", path_to_file.c_str());
+  if (!EncodeRawDataOrDie(&raw_data[0], width, height, band, data_type, max_z_error,
+                          micro_block_size, num_bytes_needed, output_path)) {
     return false;
   }
   
-  unsigned int num_bytes_blob = num_bytes_needed;
-  LercNS::Byte* lerc_buffer = new LercNS::Byte[num_bytes_blob];
+  if (!target_met) {
+    Logger::LogD("WARNING target size %zu not met by %s, %u bytes written", target_size,
+                 output_path.c_str(), num_bytes_needed);
+  }
+  if (target_met_out) {
+    *target_met_out = target_met;
+  }
+  return true;
+}
+
+bool LercUtil::SearchEncodeParamsOrDie(const std::vector<unsigned char>& raw_data, uint32_t width,
+                                       uint32_t height, uint16_t band, DataType data_type,
+                                       size_t target_size, double min_z_error, double* max_z_error,
+                                       int* micro_block_size, unsigned int* num_bytes_needed,
+                                       bool* target_met) {
+  size_t type_size = SizeOfDataType(data_type);
+  if (type_size == 0 || band == 0 ||
+      raw_data.size() < static_cast<size_t>(width) * height * band * type_size) {
+    Logger::LogD("ERROR invalid raster for search, w: %d h: %d band %d", width, height, band);
+    return false;
+  }
   
-  Logger::LogD("Try to encode dt: %d w: %d h: %d max_z_error %f band %d", lerc_dt, width, height, max_z_error, band);
+  double z_min = 0;
+  double z_max = 0;
+  if (!ComputeZRange(raw_data, data_type, &z_min, &z_max)) {
+    z_min = z_max = 0; // no valid value, every candidate is the same
+  }
   
-  if (LercNS::ErrCode::Ok != LercNS::Lerc::Encode((void*)&raw_data[0],            // raw image data, row by row, band by band
-                   3, lerc_dt, dims,
-                   width, height, band,
-                   0,                      // 0 if all pixels are valid
-                   max_z_error,            // max coding error per pixel, or precision
-                   lerc_buffer,            // buffer to write to, function will fail if buffer too small
-                   num_bytes_blob,         // buffer size
-                   num_bytes_written)) {   // num bytes written to buffer
-    Logger::LogD("ERROR when Encode %s\n", path_to_file.c_str());
+  vector<double> z_errors = MaxZErrorCandidates(data_type, z_max - z_min, min_z_error);
+  
+  // subsample
+  vector<unsigned char> sample;
+  uint32_t sample_width = width;
+  uint32_t sample_height = height;
+  const void* sample_data = &raw_data[0];
+  if (SampleWindows(raw_data, width, height, band, type_size, &sample, &sample_width, &sample_height)) {
+    sample_data = &sample[0];
+  }
+  double scale = static_cast<double>(width) * height / (static_cast<double>(sample_width) * sample_height);
+  
+  // every (micro block size, max Z error) pair is sized independently
+  struct Candidate {
+    int micro_block_size;
+    double max_z_error;
+    unsigned int num_bytes;
+    bool ok;
+  };
+  
+  vector<Candidate> candidates;
+  for (int mbs : kMicroBlockSizes) {
+    for (double z_error : z_errors) {
+      Candidate candidate = { mbs, z_error, 0, false };
+      candidates.push_back(candidate);
+    }
+  }
+  
+  ParallelFor(candidates.size(), [&](size_t i) {
+    Candidate& c = candidates[i];
+    c.ok = ComputeLercSize(sample_data, data_type, sample_width, sample_height, band,
+                           c.max_z_error, c.micro_block_size, &c.num_bytes);
+  });
+  
+  // finest error within budget, fewer bytes on ties; smallest output if nothing fits
+  const Candidate* best = nullptr;
+  const Candidate* smallest = nullptr;
+  for (const Candidate& c : candidates) {
+    if (!c.ok) continue;
+    if (smallest == nullptr || c.num_bytes < smallest->num_bytes) {
+      smallest = &c;
+    }
+    if (c.num_bytes * scale > target_size) continue;
+    if (best == nullptr || c.max_z_error < best->max_z_error ||
+        (c.max_z_error == best->max_z_error && c.num_bytes < best->num_bytes)) {
+      best = &c;
+    }
+  }
+  
+  if (smallest == nullptr) {
     return false;
   }
   
-  // write to file
-  FILE* file = fopen(output_path.c_str(), "wb");
-  fwrite(lerc_buffer, 1, num_bytes_written, file); // write bytes
-  fclose(file);
+  if (best == nullptr) {
+    best = smallest;
+  }
+  
+  // the sample is only an estimate, binary search the ladder on full raster sizes for the
+  // finest error that fits, probing the sample's pick first
+  *micro_block_size = best->micro_block_size;
+  *target_met = false;
+  
+  vector<unsigned int> full_sizes(z_errors.size(), 0);
+  size_t fit_index = z_errors.size();
+  size_t lo = 0;
+  size_t hi = z_errors.size() - 1;
+  size_t probe = std::find(z_errors.begin(), z_errors.end(), best->max_z_error) - z_errors.begin();
+  
+  while (lo <= hi) {
+    if (!ComputeLercSize(&raw_data[0], data_type, width, height, band, z_errors[probe],
+                         *micro_block_size, &full_sizes[probe])) {
+      return false;
+    }
+    if (full_sizes[probe] <= target_size) {
+      fit_index = probe;
+      if (probe == 0) break;
+      hi = probe - 1;
+    } else {
+      lo = probe + 1;
+    }
+    probe = lo + (hi - lo) / 2;
+  }
+  
+  if (fit_index == z_errors.size()) { // the coarsest rung was the last probe
+    *max_z_error = z_errors.back();
+    *num_bytes_needed = full_sizes.back();
+  } else {
+    *target_met = true;
+    *max_z_error = z_errors[fit_index];
+    *num_bytes_needed = full_sizes[fit_index];
+    
+    // bisect between the rung that fits and the finer one that does not
+    bool is_integer = IsIntegerDataType(data_type);
+    double too_fine = fit_index > 0 ? z_errors[fit_index - 1] : *max_z_error;
+    for (int pass = 0; pass < kMaxBisectPasses; ++pass) {
+      double z_error = sqrt(too_fine * *max_z_error);
+      if (is_integer) z_error = floor(z_error);
+      if (!(z_error > too_fine && z_error < *max_z_error)) break;
+      
+      unsigned int num_bytes = 0;
+      if (!ComputeLercSize(&raw_data[0], data_type, width, height, band, z_error,
+                           *micro_block_size, &num_bytes)) {
+        return false;
+      }
+      if (num_bytes <= target_size) {
+        *max_z_error = z_error;
+        *num_bytes_needed = num_bytes;
+      } else {
+        too_fine = z_error;
+      }
+    }
+  }
+  
+  if (!*target_met) {
+    Logger::LogD("Target size %zu not met, coarsest max_z_error %f micro_block_size %d needs %u bytes",
+                 target_size, *max_z_error, *micro_block_size, *num_bytes_needed);
+    return true;
+  }
+  
+  Logger::LogD("Picked max_z_error %f micro_block_size %d, %u bytes for target %zu",
+               *max_z_error, *micro_block_size, *num_bytes_needed, target_size);
+  return true;
+}
+
+// Verify --------------------------------------------------------
+
+bool LercUtil::VerifyLercOrDie(const std::string& path_to_tiff, const std::string& path_to_lerc,
+                               uint16_t band, VerifyStats* stats) {
+  vector<std::string> lerc_paths;
+  if (FileExists(path_to_lerc)) {
+    lerc_paths.push_back(path_to_lerc);
+  } else {
+    for (size_t i = 0; FileExists(StripPath(path_to_lerc, i)); ++i) {
+      lerc_paths.push_back(StripPath(path_to_lerc, i));
+    }
+  }
+  if (lerc_paths.empty()) {
+    Logger::LogD("ERROR when fopen %s", path_to_lerc.c_str());
+    return false;
+  }
+  
+  TIFF* tif = TIFFOpen(path_to_tiff.c_str(), "r");
+  if (tif == nullptr) {
+    Logger::LogD("ERROR when TIFFOpen %s\n", path_to_tiff.c_str());
+    return false;
+  }
+  
+  bool success = VerifyLercStrips(tif, path_to_tiff, lerc_paths, band, stats);
+  
+  TIFFClose(tif);
+  return success;
+}
+
+// Memory --------------------------------------------------------
+
+// Lerc data type of the TypedRaster types
+template<typename T> struct LercDataTypeOf;
+template<> struct LercDataTypeOf<char>           { static const LercNS::Lerc::DataType value = LercNS::Lerc::DT_Char; };
+template<> struct LercDataTypeOf<unsigned char>  { static const LercNS::Lerc::DataType value = LercNS::Lerc::DT_Byte; };
+template<> struct LercDataTypeOf<short>          { static const LercNS::Lerc::DataType value = LercNS::Lerc::DT_Short; };
+template<> struct LercDataTypeOf<unsigned short> { static const LercNS::Lerc::DataType value = LercNS::Lerc::DT_UShort; };
+template<> struct LercDataTypeOf<int>            { static const LercNS::Lerc::DataType value = LercNS::Lerc::DT_Int; };
+template<> struct LercDataTypeOf<unsigned int>   { static const LercNS::Lerc::DataType value = LercNS::Lerc::DT_UInt; };
+template<> struct LercDataTypeOf<float>          { static const LercNS::Lerc::DataType value = LercNS::Lerc::DT_Float; };
+template<> struct LercDataTypeOf<double>         { static const LercNS::Lerc::DataType value = LercNS::Lerc::DT_Double; };
+
+// Decodes into caller owned pixels of nDim * nCols * nRows * nBands values.
+template<typename T>
+static bool DecodeTempl(const unsigned char* lerc_blob, size_t lerc_size,
+                        const LercNS::Lerc::LercInfo& info, T* data) {
+  if (LercNS::ErrCode::Ok != LercNS::Lerc::DecodeTempl(data, lerc_blob, static_cast<unsigned int>(lerc_size),
+                                                       info.nDim, info.nCols, info.nRows, info.nBands,
+                                                       nullptr)) {
+    Logger::LogD("ERROR when Decode");
+    return false;
+  }
+  return true;
+}
+
+static bool GetLercInfoOrDie(const unsigned char* lerc_blob, size_t lerc_size, LercNS::Lerc::LercInfo* info) {
+  if (lerc_blob == nullptr || lerc_size > static_cast<size_t>(std::numeric_limits<int>::max()) ||
+      LercNS::ErrCode::Ok != LercNS::Lerc::GetLercInfo(lerc_blob, static_cast<unsigned int>(lerc_size), *info)) {
+    Logger::LogD("ERROR when GetLercInfo");
+    return false;
+  }
+  if (info->nDim != 1) {
+    Logger::LogD("ERROR LERC has %d values per pixel, rasters hold 1", info->nDim);
+    return false;
+  }
+  return true;
+}
+
+bool LercUtil::ReadTiffOrDie(const std::string& path_to_file, Raster* raster) {
+  TIFF* tif = TIFFOpen(path_to_file.c_str(), "r");
+  if (tif == nullptr) {
+    Logger::LogD("ERROR when TIFFOpen %s\n", path_to_file.c_str());
+    return false;
+  }
+  
+  bool success = ReadTiffRaster(tif, path_to_file, raster);
+  
+  TIFFClose(tif);
+  return success;
+}
+
+bool LercUtil::ReadTiffFromMemoryOrDie(const unsigned char* tiff_data, size_t tiff_size, Raster* raster) {
+  TiffMemoryStream stream = { tiff_data, static_cast<toff_t>(tiff_size), 0 };
+  
+  TIFF* tif = TIFFClientOpen("memory", "r", static_cast<thandle_t>(&stream),
+                             TiffMemoryRead, TiffMemoryWrite, TiffMemorySeek, TiffMemoryClose,
+                             TiffMemorySize, TiffMemoryMap, TiffMemoryUnmap);
+  if (tif == nullptr) {
+    Logger::LogD("ERROR when TIFFClientOpen");
+    return false;
+  }
+  
+  bool success = ReadTiffRaster(tif, "memory", raster);
+  
+  TIFFClose(tif);
+  return success;
+}
+
+bool LercUtil::EncodeOrDie(const Raster& raster, double max_z_error, std::vector<unsigned char>* lerc_blob) {
+  size_t num_bytes_raw = static_cast<size_t>(raster.width) * raster.height * raster.band *
+      SizeOfDataType(raster.data_type);
+  if (num_bytes_raw == 0 || raster.data.size() != num_bytes_raw) {
+    Logger::LogD("ERROR raster holds %zu bytes, %zu needed", raster.data.size(), num_bytes_raw);
+    return false;
+  }
+  
+  const void* data = &raster.data[0];
+  uint32_t w = raster.width;
+  uint32_t h = raster.height;
+  uint16_t b = raster.band;
+  
+  switch (raster.data_type) {
+    case DataType::CHAR:   return EncodeOrDie(static_cast<const char*>(data), w, h, b, max_z_error, lerc_blob);
+    case DataType::BYTE:   return EncodeOrDie(static_cast<const unsigned char*>(data), w, h, b, max_z_error, lerc_blob);
+    case DataType::SHORT:  return EncodeOrDie(static_cast<const short*>(data), w, h, b, max_z_error, lerc_blob);
+    case DataType::USHORT: return EncodeOrDie(static_cast<const unsigned short*>(data), w, h, b, max_z_error, lerc_blob);
+    case DataType::INT:    return EncodeOrDie(static_cast<const int*>(data), w, h, b, max_z_error, lerc_blob);
+    case DataType::UINT:   return EncodeOrDie(static_cast<const unsigned int*>(data), w, h, b, max_z_error, lerc_blob);
+    case DataType::FLOAT:  return EncodeOrDie(static_cast<const float*>(data), w, h, b, max_z_error, lerc_blob);
+    case DataType::DOUBLE: return EncodeOrDie(static_cast<const double*>(data), w, h, b, max_z_error, lerc_blob);
+    default:
+      Logger::LogD("ERROR input data type %d", static_cast<int>(raster.data_type));
+      return false;
+  }
+}
+
+template<typename T>
+bool LercUtil::EncodeOrDie(const T* data, uint32_t width, uint32_t height, uint16_t band,
+                           double max_z_error, std::vector<unsigned char>* lerc_blob) {
+  if (static_cast<uint64_t>(width) * height * band * sizeof(T) > kMaxLercBlobBytes) {
+    Logger::LogD("ERROR raster is over %llu bytes, encode it in row strips",
+                 static_cast<unsigned long long>(kMaxLercBlobBytes));
+    return false;
+  }
+  
+  int dims = 1; // one value per pixel, see lerc_util.h
+  
+  unsigned int num_bytes_needed = 0;
+  if (LercNS::ErrCode::Ok != LercNS::Lerc::ComputeCompressedSizeTempl(data, kLercCodecVersion, dims,
+                                                                      width, height, band,
+                                                                      nullptr, max_z_error,
+                                                                      num_bytes_needed) ||
+      !IsLercSizeValid(num_bytes_needed)) {
+    Logger::LogD("ERROR when ComputeBufferSize");
+    return false;
+  }
+  
+  lerc_blob->resize(num_bytes_needed);
+  
+  unsigned int num_bytes_written = 0;
+  if (LercNS::ErrCode::Ok != LercNS::Lerc::EncodeTempl(data, kLercCodecVersion, dims,
+                                                       width, height, band,
+                                                       nullptr, max_z_error,
+                                                       &(*lerc_blob)[0], num_bytes_needed,
+                                                       num_bytes_written)) {
+    Logger::LogD("ERROR when Encode");
+    return false;
+  }
   
+  lerc_blob->resize(num_bytes_written);
   return true;
 }
 
+bool LercUtil::DecodeOrDie(const unsigned char* lerc_blob, size_t lerc_size, Raster* raster) {
+  LercNS::Lerc::LercInfo info;
+  if (!GetLercInfoOrDie(lerc_blob, lerc_size, &info)) {
+    return false;
+  }
+  
+  size_t num_bytes_raw = static_cast<size_t>(info.nCols) * info.nRows * info.nBands *
+      SizeOfDataType(static_cast<DataType>(info.dt));
+  if (num_bytes_raw == 0) {
+    Logger::LogD("ERROR LERC data type %d", static_cast<int>(info.dt));
+    return false;
+  }
+  
+  raster->width = info.nCols;
+  raster->height = info.nRows;
+  raster->band = info.nBands;
+  raster->data_type = static_cast<DataType>(info.dt);
+  raster->data.resize(num_bytes_raw);
+  
+  void* data = &raster->data[0];
+  
+  switch (raster->data_type) {
+    case DataType::CHAR:   return DecodeTempl(lerc_blob, lerc_size, info, static_cast<char*>(data));
+    case DataType::BYTE:   return DecodeTempl(lerc_blob, lerc_size, info, static_cast<unsigned char*>(data));
+    case DataType::SHORT:  return DecodeTempl(lerc_blob, lerc_size, info, static_cast<short*>(data));
+    case DataType::USHORT: return DecodeTempl(lerc_blob, lerc_size, info, static_cast<unsigned short*>(data));
+    case DataType::INT:    return DecodeTempl(lerc_blob, lerc_size, info, static_cast<int*>(data));
+    case DataType::UINT:   return DecodeTempl(lerc_blob, lerc_size, info, static_cast<unsigned int*>(data));
+    case DataType::FLOAT:  return DecodeTempl(lerc_blob, lerc_size, info, static_cast<float*>(data));
+    case DataType::DOUBLE: return DecodeTempl(lerc_blob, lerc_size, info, static_cast<double*>(data));
+    default:
+      Logger::LogD("ERROR LERC data type %d", static_cast<int>(info.dt));
+      return false;
+  }
+}
+
+template<typename T>
+bool LercUtil::DecodeOrDie(const unsigned char* lerc_blob, size_t lerc_size, TypedRaster<T>* raster) {
+  LercNS::Lerc::LercInfo info;
+  if (!GetLercInfoOrDie(lerc_blob, lerc_size, &info)) {
+    return false;
+  }
+  
+  if (info.dt != LercDataTypeOf<T>::value) {
+    Logger::LogD("ERROR LERC data type %d does not match %d", info.dt, LercDataTypeOf<T>::value);
+    return false;
+  }
+  
+  size_t num_values = static_cast<size_t>(info.nCols) * info.nRows * info.nBands;
+  if (num_values == 0) {
+    Logger::LogD("ERROR LERC is empty");
+    return false;
+  }
+  
+  raster->width = info.nCols;
+  raster->height = info.nRows;
+  raster->band = info.nBands;
+  raster->data.resize(num_values);
+  
+  return DecodeTempl(lerc_blob, lerc_size, info, &raster->data[0]);
+}
+
+// typed APIs are provided for the data types supported by Lerc
+#define GAGO_INSTANTIATE_LERC_UTIL_TEMPL(T) \
+  template bool LercUtil::EncodeOrDie(const T*, uint32_t, uint32_t, uint16_t, double, std::vector<unsigned char>*); \
+  template bool LercUtil::DecodeOrDie(const unsigned char*, size_t, TypedRaster<T>*);
+
+GAGO_INSTANTIATE_LERC_UTIL_TEMPL(char)
+GAGO_INSTANTIATE_LERC_UTIL_TEMPL(unsigned char)
+GAGO_INSTANTIATE_LERC_UTIL_TEMPL(short)
+GAGO_INSTANTIATE_LERC_UTIL_TEMPL(unsigned short)
+GAGO_INSTANTIATE_LERC_UTIL_TEMPL(int)
+GAGO_INSTANTIATE_LERC_UTIL_TEMPL(unsigned int)
+GAGO_INSTANTIATE_LERC_UTIL_TEMPL(float)
+GAGO_INSTANTIATE_LERC_UTIL_TEMPL(double)
+
+#undef GAGO_INSTANTIATE_LERC_UTIL_TEMPL
+
 NS_GAGO_END
@@ -57,12 +57,51 @@ public:
     UNKNOWN,
   };
   
+  // Raster held in memory, one value per pixel, row by row, band by band. Owns its pixels,
+  // move it instead of copying.
+  struct Raster {
+    Raster() : width(0), height(0), band(0), data_type(DataType::UNKNOWN) {}
+    
+    uint32_t width;
+    uint32_t height;
+    uint16_t band;
+    DataType data_type;
+    std::vector<unsigned char> data;
+  };
+  
+  // Raster whose data type is known at compile time, T is one of char, unsigned char,
+  // short, unsigned short, int, unsigned int, float or double.
+  template<typename T>
+  struct TypedRaster {
+    TypedRaster() : width(0), height(0), band(0) {}
+    
+    uint32_t width;
+    uint32_t height;
+    uint16_t band;
+    std::vector<T> data;
+  };
+  
+  // Result of VerifyLercOrDie
+  struct VerifyStats {
+    double max_error;          // max absolute difference between source and decoded pixels
+    double lerc_max_z_error;   // max Z error stored in the LERC, largest over bands
+    double tolerance;          // float rounding of decoded pixels allowed on top of a max Z error
+    uint64_t num_bytes_lerc;   // LERC file size, summed over strips
+    uint64_t num_bytes_raw;    // decoded pixel data size
+  };
+  
+  // Largest raw raster a single LERC blob is encoded from, larger rasters are split into row
+  // strips of at most this many bytes. Lerc2 keeps pixel counts, blob sizes and most bit counts
+  // in int, 2^28 bytes hold at most 2^28 values and code to about 2^31 bits.
+  static const uint64_t kMaxLercBlobBytes = 1ULL << 28;
+  
   //enum DataType { DT_Char, DT_Byte, DT_Short, DT_UShort, DT_Int, DT_UInt, DT_Float, DT_Double, DT_Undefined };
   
   // TIFF --------------------------------------------------------
   
   /**
-   *  Encode TIFF to Lerc (lerc2 v3).
+   *  Encode TIFF to Lerc (lerc2 v3). Rasters over kMaxLercBlobBytes are split into strips,
+   *  see EncodeTiffInStripsOrDie.
    *
    *  @param path_to_file Input TIFF path.
    *  @param output_path  Output LERC path.
@@ -75,6 +114,31 @@ public:
   static bool EncodeTiffOrDie(const std::string& path_to_file, const std::string& output_path,
                               double max_z_error, LercVersion lerc_ver, uint16_t band);
   
+  /**
+   *  Encode TIFF or BigTIFF to Lerc (lerc2 v3) one row strip at a time, so rasters larger
+   *  than memory or than a Lerc2 blob can hold are encoded too. A raster that fits in
+   *  max_blob_bytes is written to output_path, otherwise strip i is written to
+   *  StripPath(output_path, i), rows are cut at whole TIFF tiles where a tile row fits.
+   *
+   *  @param path_to_file   Input TIFF path.
+   *  @param output_path    Output LERC path.
+   *  @param max_z_error    Max Z error defined in LERC.
+   *  @param lerc_ver       LERC version number, only supports V2_3 right now.
+   *  @param band           Band of TIFF, grayscale is 1, RGB is 3 and RGBA is 4.
+   *  @param max_blob_bytes Raw bytes per strip, at most kMaxLercBlobBytes.
+   *
+   *  @return Returns false if encodes failed.
+   */
+  static bool EncodeTiffInStripsOrDie(const std::string& path_to_file, const std::string& output_path,
+                                      double max_z_error, LercVersion lerc_ver, uint16_t band,
+                                      uint64_t max_blob_bytes);
+  
+  /**
+   Path of strip index of a split LERC, "name.lerc" becomes "name.lerc.<index>" so it can not
+   clash with the output of another TIFF.
+   */
+  static std::string StripPath(const std::string& output_path, size_t index);
+  
   /**
    Read TIFF info, including data type, width, height and pixel data.
 
@@ -91,6 +155,134 @@ public:
                             uint32_t* dims, DataType* data_type,
                             std::vector<unsigned char>* raw_data);
   
+  // Target size --------------------------------------------------------
+  
+  /**
+   *  Encode TIFF to Lerc (lerc2 v3) with the finest max Z error that fits in a budget.
+   *
+   *  @param path_to_file   Input TIFF path.
+   *  @param output_path    Output LERC path.
+   *  @param target_size    Byte budget of the output LERC, 0 to use target_bpp instead.
+   *  @param target_bpp     Bits per pixel budget, only used when target_size is 0.
+   *  @param min_z_error    Finest max Z error the search is allowed to pick.
+   *  @param lerc_ver       LERC version number, only supports V2_3 right now.
+   *  @param band           Band of TIFF, grayscale is 1, RGB is 3 and RGBA is 4.
+   *  @param target_met     Optional, set to false when no max Z error meets the budget, the
+   *                        smallest encode found is still written then.
+   *
+   *  @return Returns false if encodes failed, in which case nothing is written.
+   */
+  static bool EncodeTiffToTargetSizeOrDie(const std::string& path_to_file, const std::string& output_path,
+                                          size_t target_size, double target_bpp, double min_z_error,
+                                          LercVersion lerc_ver, uint16_t band, bool* target_met = nullptr);
+  
+  /**
+   Search max Z error and micro block size of the smallest error encode whose size is within
+   target_size. Candidates are tried concurrently on a subsample of blocks, the pick then seeds
+   a binary search of the candidates on the full raster, and the error is bisected between the
+   last candidate that fits and the next finer one in a few more full raster passes.
+
+   @param raw_data         Pixel data, band by band.
+   @param width            Image width.
+   @param height           Image height.
+   @param band             Number of bands.
+   @param data_type        Image data type.
+   @param target_size      Byte budget of the whole LERC blob.
+   @param min_z_error      Finest max Z error the search is allowed to pick.
+   @param max_z_error      Picked max Z error.
+   @param micro_block_size Picked micro block size.
+   @param num_bytes_needed Exact LERC blob size of the picked setting.
+   @param target_met       Whether num_bytes_needed is within target_size, if not the
+                           coarsest setting is picked.
+
+   @return Returns false if searches failed, a budget that cannot be met is not a failure.
+   */
+  static bool SearchEncodeParamsOrDie(const std::vector<unsigned char>& raw_data, uint32_t width,
+                                      uint32_t height, uint16_t band, DataType data_type,
+                                      size_t target_size, double min_z_error, double* max_z_error,
+                                      int* micro_block_size, unsigned int* num_bytes_needed,
+                                      bool* target_met);
+  
+  // Verify --------------------------------------------------------
+  
+  /**
+   Decode a LERC file, check its Fletcher-32 checksums and compare it against its source TIFF.
+   If path_to_lerc does not exist its strips are verified in order instead, see
+   EncodeTiffInStripsOrDie. Thread safe, so a batch of files can be verified concurrently.
+
+   @param path_to_tiff Source TIFF path.
+   @param path_to_lerc LERC path encoded from the TIFF.
+   @param band         Band of TIFF, grayscale is 1, RGB is 3 and RGBA is 4.
+   @param stats        Errors and sizes of the pair.
+
+   @return Returns false if either file can not be read, they do not match in size or type,
+           or the LERC fails its checksum or decoding.
+   */
+  static bool VerifyLercOrDie(const std::string& path_to_tiff, const std::string& path_to_lerc,
+                              uint16_t band, VerifyStats* stats);
+  
+  // Memory --------------------------------------------------------
+  
+  /**
+   Read TIFF into a raster, band is the TIFF samples per pixel. Interleaved samples are
+   split into one band after another, TIFFs with separate sample planes are not supported.
+
+   @param path_to_file Input TIFF path.
+   @param raster       Raster to fill, its data is replaced.
+
+   @return Returns false if reads failed.
+   */
+  static bool ReadTiffOrDie(const std::string& path_to_file, Raster* raster);
+  
+  /**
+   Read TIFF from a caller buffer through a libtiff memory stream, without temp files.
+   The buffer must outlive the call only, uncompressed strips are read straight from it.
+
+   @param tiff_data Whole TIFF file in memory.
+   @param tiff_size Size of tiff_data in bytes.
+   @param raster    Raster to fill, its data is replaced.
+
+   @return Returns false if reads failed.
+   */
+  static bool ReadTiffFromMemoryOrDie(const unsigned char* tiff_data, size_t tiff_size, Raster* raster);
+  
+  /**
+   Encode a raster to a LERC blob (lerc2 v3) in memory, one value per pixel (nDim 1).
+
+   @param raster      Raster to encode.
+   @param max_z_error Max Z error defined in LERC.
+   @param lerc_blob   Blob to fill, its content is replaced.
+
+   @return Returns false if encodes failed.
+   */
+  static bool EncodeOrDie(const Raster& raster, double max_z_error, std::vector<unsigned char>* lerc_blob);
+  
+  /**
+   Same as above for data whose type is known at compile time, skips the DataType switch.
+   T is one of the TypedRaster types.
+   */
+  template<typename T>
+  static bool EncodeOrDie(const T* data, uint32_t width, uint32_t height, uint16_t band,
+                          double max_z_error, std::vector<unsigned char>* lerc_blob);
+  
+  /**
+   Decode a LERC blob in memory. Blobs with more than one value per pixel are rejected.
+
+   @param lerc_blob LERC blob.
+   @param lerc_size Size of lerc_blob in bytes.
+   @param raster    Raster to fill, its data is replaced.
+
+   @return Returns false if decodes failed.
+   */
+  static bool DecodeOrDie(const unsigned char* lerc_blob, size_t lerc_size, Raster* raster);
+  
+  /**
+   Same as above for data whose type is known at compile time, skips the DataType switch.
+   Fails if the blob holds a different data type than T.
+   */
+  template<typename T>
+  static bool DecodeOrDie(const unsigned char* lerc_blob, size_t lerc_size, TypedRaster<T>* raster);
+  
 private:
   
   // Creation and lifetime --------------------------------------------------------
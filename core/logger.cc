@@ -42,8 +42,7 @@ void Logger::LogD(const char*format, ... ) {
   va_start(ap, format);
   vsnprintf(buf, kMaxLogLen, format, ap);
   va_end(ap);
-  printf("%s", buf);
-  printf("\n");
+  printf("%s\n", buf); // one call, so lines from worker threads do not interleave
 //#endif
 }
 
@@ -0,0 +1,66 @@
+// parallel.h
+//
+// Copyright (c) 2016 Frank Lin (lin.xiaoe.f@gmail.com)
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef LERC_CORE_PARALLEL_H_
+#define LERC_CORE_PARALLEL_H_
+
+#include <stddef.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "macros.h"
+
+NS_GAGO_BEGIN
+
+/**
+ Call fn(0) ... fn(count - 1) on one thread per core, the calling thread included.
+ Indices are handed out one at a time, so jobs of uneven cost keep every thread busy.
+ Returns once all calls are done.
+ */
+inline void ParallelFor(size_t count, const std::function<void(size_t)>& fn) {
+  std::atomic<size_t> next_index(0);
+  auto worker = [&]() {
+    size_t i = 0;
+    while ((i = next_index++) < count) {
+      fn(i);
+    }
+  };
+  
+  size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+  num_threads = std::min(num_threads, count);
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; ++i) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (std::thread& t : threads) {
+    t.join();
+  }
+}
+
+NS_GAGO_END
+
+#endif /* LERC_CORE_PARALLEL_H_ */
@@ -24,22 +24,36 @@
 //                                  --output <folder_name_with_slash_or_tiff_name_wo_slash>
 //                                  --band <band>
 //                                  --maxzerror <max_z_error>
+//                                  [--targetsize <bytes> | --targetbpp <bits_per_pixel>]
+//                                  [--verify]
+//                                  [--maxblobbytes <bytes>]
+//
+// --rawdata writes width, height, data type, len, band (32-bit each) and the pixels, rasters
+// of 4 GB and more store len as 0xffffffff followed by the 64-bit len after band.
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "lerc_util.h"
+#include "parallel.h"
 
 struct RawImage {
   uint32_t width;
   uint32_t height;
-  uint32_t len;
+  uint64_t len;
   uint32_t band;
   gago::LercUtil::DataType data_type;
   std::vector<unsigned char> raw_data;
@@ -68,15 +82,126 @@ void write_raw_data_to_file(const struct RawImage& raw_image, const std::string&
   fwrite(&raw_image.width, sizeof(uint32_t), 1, fp);
   fwrite(&raw_image.height, sizeof(uint32_t), 1, fp);
   fwrite(&raw_image.data_type, sizeof(int), 1, fp);
-  fwrite(&raw_image.len, sizeof(uint32_t), 1, fp);
+  
+  // keep the 32-bit layout readers expect unless len does not fit
+  bool is_len_64 = raw_image.len >= UINT32_MAX;
+  uint32_t len_32 = is_len_64 ? UINT32_MAX : static_cast<uint32_t>(raw_image.len);
+  fwrite(&len_32, sizeof(uint32_t), 1, fp);
   fwrite(&raw_image.band, sizeof(uint32_t), 1, fp);
+  if (is_len_64) {
+    fwrite(&raw_image.len, sizeof(uint64_t), 1, fp);
+  }
+  
   fwrite(&raw_image.raw_data[0], sizeof(unsigned char), raw_image.raw_data.size(), fp);
   
   fclose(fp);
 }
 
+// Called with every TIFF found and the LERC path it maps to in the output folder.
+typedef std::function<void(const std::string& tiff_path, const std::string& lerc_path)> TiffVisitor;
+
+// Outcome of encoding one TIFF, a missed budget still writes the smallest encode found.
+enum EncodeResult {
+  ENCODE_OK,
+  ENCODE_TARGET_MISSED,
+  ENCODE_FAILED
+};
+
+EncodeResult encode_tiff(const std::string& file_path, const std::string& dest_file_name, double max_z_error,
+                         int band, size_t target_size, double target_bpp, uint64_t max_blob_bytes) {
+  bool success = false;
+  bool target_met = true;
+  if (target_size > 0 || target_bpp > 0) {
+    success = gago::LercUtil::EncodeTiffToTargetSizeOrDie(file_path,
+                                                         dest_file_name,
+                                                         target_size,
+                                                         target_bpp,
+                                                         max_z_error,
+                                                         gago::LercUtil::LercVersion::V2_3,
+                                                         band,
+                                                         &target_met);
+  } else {
+    success = gago::LercUtil::EncodeTiffInStripsOrDie(file_path,
+                                                     dest_file_name,
+                                                     max_z_error,
+                                                     gago::LercUtil::LercVersion::V2_3,
+                                                     band,
+                                                     max_blob_bytes);
+  }
+  if (!success) {
+    gago::Logger::LogD("%s encode failed", file_path.c_str());
+    return ENCODE_FAILED;
+  }
+  if (!target_met) {
+    gago::Logger::LogD("%s written over target size", file_path.c_str());
+    return ENCODE_TARGET_MISSED;
+  }
+  return ENCODE_OK;
+}
+
+// Decodes every (tiff, lerc) pair concurrently and compares it against its source, returns false
+// if any pair fails or exceeds the max Z error stored in its lerc. With check_given the given
+// max_z_error must hold too, target size encodes store a coarser one on purpose.
+bool verify_tiffs(const std::vector<std::pair<std::string, std::string> >& jobs, double max_z_error, int band,
+                  bool check_given) {
+  struct VerifyResult {
+    bool success;
+    gago::LercUtil::VerifyStats stats;
+  };
+  std::vector<VerifyResult> results(jobs.size());
+  
+  auto start = std::chrono::steady_clock::now();
+  
+  gago::ParallelFor(jobs.size(), [&](size_t i) {
+    results[i].success = gago::LercUtil::VerifyLercOrDie(jobs[i].first, jobs[i].second, band,
+                                                         &results[i].stats);
+  });
+  
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  
+  size_t num_failed = 0;
+  uint64_t num_bytes_raw = 0;
+  uint64_t num_bytes_lerc = 0;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    const VerifyResult& result = results[i];
+    if (!result.success) {
+      ++num_failed;
+      gago::Logger::LogD("FAIL %s unreadable or corrupted", jobs[i].second.c_str());
+      continue;
+    }
+    
+    const gago::LercUtil::VerifyStats& stats = result.stats;
+    bool within_encoded = stats.max_error <= stats.lerc_max_z_error + stats.tolerance;
+    bool within_given = !check_given || stats.max_error <= max_z_error + stats.tolerance;
+    if (!within_encoded || !within_given) {
+      ++num_failed;
+    }
+    num_bytes_raw += stats.num_bytes_raw;
+    num_bytes_lerc += stats.num_bytes_lerc;
+    gago::Logger::LogD("%s %s max error %f, max Z error given %f, encoded %f%s",
+                       within_encoded && within_given ? "OK  " : "FAIL",
+                       jobs[i].second.c_str(),
+                       stats.max_error,
+                       max_z_error,
+                       stats.lerc_max_z_error,
+                       !within_encoded ? ", over encoded" : (!within_given ? ", over given" : ""));
+  }
+  
+  gago::Logger::LogD("Verified %zu files, %zu failed, %.1f MB raw from %.1f MB lerc in %.2f s, %.1f MB/s, %.1f files/s",
+                     jobs.size(),
+                     num_failed,
+                     num_bytes_raw / 1e6,
+                     num_bytes_lerc / 1e6,
+                     seconds,
+                     seconds > 0 ? num_bytes_raw / 1e6 / seconds : 0,
+                     seconds > 0 ? jobs.size() / seconds : 0);
+  
+  return num_failed == 0;
+}
+
 void list_files_do_stuff(const char* name, int level, const std::string& input_path,
-                         const std::string& output_path, double max_z_error, int band) {
+                         const std::string& output_path, bool create_output_dirs,
+                         const TiffVisitor& visitor) {
   DIR *dir;
   struct dirent *entry;
   
@@ -111,10 +236,12 @@ void list_files_do_stuff(const char* name, int level, const std::string& input_p
       spec_output_folder += "/";
       spec_output_folder += entry->d_name;
       spec_output_folder.replace(spec_output_folder.begin(), spec_output_folder.begin() + input_path.size(), output_path);
-      create_directory(spec_output_folder.c_str());
+      if (create_output_dirs) {
+        create_directory(spec_output_folder.c_str());
+      }
       
       // continue
-      list_files_do_stuff(path, level + 1, input_path, output_path, max_z_error, band);
+      list_files_do_stuff(path, level + 1, input_path, output_path, create_output_dirs, visitor);
     } else {
       if ((0 == strcmp("tif", get_filename_ext(entry->d_name))) ||
           (0 == strcmp("tiff", get_filename_ext(entry->d_name)))) { // allow tif and tiff extension
@@ -129,14 +256,7 @@ void list_files_do_stuff(const char* name, int level, const std::string& input_p
         dest_file_name += ".lerc";
         dest_file_name.replace(dest_file_name.begin(), dest_file_name.begin() + input_path.size(), output_path);
         
-        bool success = gago::LercUtil::EncodeTiffOrDie(file_path,
-                                                      dest_file_name,
-                                                      max_z_error,
-                                                      gago::LercUtil::LercVersion::V2_3,
-                                                      band);
-        if (!success) {
-          gago::Logger::LogD("%s encode failed", file_path.c_str());
-        }
+        visitor(file_path, dest_file_name);
       }
     }
   } while ((entry = readdir(dir)));
@@ -149,6 +269,10 @@ int main(int argc, const char * argv[]) {
   uint32_t band = 0;
   double max_z_error = 0; // losses
   bool output_raw_data = false; // output raw data
+  size_t target_size = 0; // byte budget per lerc, max Z error is searched if set
+  double target_bpp = 0; // bits per pixel budget, used if target size is not given
+  bool verify = false; // check existing lercs in output against the tiffs in input
+  uint64_t max_blob_bytes = gago::LercUtil::kMaxLercBlobBytes; // larger rasters are split into strips
   
   // parse input arguments
   for (int i = 0; i < argc; ++i) {
@@ -162,6 +286,14 @@ int main(int argc, const char * argv[]) {
       max_z_error = atof(argv[i + 1]);
     } else if (0 == strcmp("--rawdata", argv[i])) {
       output_raw_data = true;
+    } else if (0 == strcmp("--targetsize", argv[i])) {
+      target_size = strtoull(argv[i + 1], nullptr, 10);
+    } else if (0 == strcmp("--targetbpp", argv[i])) {
+      target_bpp = atof(argv[i + 1]);
+    } else if (0 == strcmp("--verify", argv[i])) {
+      verify = true;
+    } else if (0 == strcmp("--maxblobbytes", argv[i])) {
+      max_blob_bytes = strtoull(argv[i + 1], nullptr, 10);
     }
   }
   
@@ -180,7 +312,39 @@ int main(int argc, const char * argv[]) {
     }
   }
   
-  if (is_directory) { // loop directory recursively to covert tiffs to lercs
+  // encodes run one file after another, plain counters are enough
+  size_t num_failed = 0;
+  size_t num_missed = 0;
+  auto count_result = [&](EncodeResult result) {
+    if (result == ENCODE_FAILED) {
+      ++num_failed;
+    } else if (result == ENCODE_TARGET_MISSED) {
+      ++num_missed;
+    }
+  };
+  
+  if (verify) { // decode lercs in output and compare them against tiffs in input
+    std::vector<std::pair<std::string, std::string> > jobs;
+    if (is_directory) {
+      input_path = input_path.substr(0, input_path.size() - 1);
+      output_path = output_path.substr(0, output_path.size() - 1);
+      
+      list_files_do_stuff(input_path.c_str(),
+                          0,
+                          input_path,
+                          output_path,
+                          false,
+                          [&jobs](const std::string& tiff_path, const std::string& lerc_path) {
+                            jobs.push_back(std::make_pair(tiff_path, lerc_path));
+                          });
+    } else {
+      jobs.push_back(std::make_pair(input_path, output_path));
+    }
+    
+    if (!verify_tiffs(jobs, max_z_error, band, target_size == 0 && target_bpp == 0)) {
+      return EXIT_FAILURE;
+    }
+  } else if (is_directory) { // loop directory recursively to covert tiffs to lercs
     // remove last slash
     // for compact with previous version implementation
     input_path = input_path.substr(0, input_path.size() - 1);
@@ -194,35 +358,36 @@ int main(int argc, const char * argv[]) {
                         0,
                         input_path,
                         output_path,
-                        max_z_error,
-                        band);
+                        true,
+                        [&](const std::string& tiff_path, const std::string& lerc_path) {
+                          count_result(encode_tiff(tiff_path, lerc_path, max_z_error, band, target_size,
+                                                   target_bpp, max_blob_bytes));
+                        });
   } else { // treat input path as file and convert tiff to lerc
     if (output_raw_data) {
-      uint32_t width = 0;
-      uint32_t height = 0;
+      // pixels are kept as laid out in the TIFF, read straight into the image
+      struct RawImage raw_image;
       uint32_t dims = 0;
-      gago::LercUtil::DataType dt;
-      std::vector<unsigned char> raw_data;
-      if (gago::LercUtil::ReadTiffOrDie(input_path, &width, &height, &dims, &dt, &raw_data)) {
-        struct RawImage raw_image;
-        raw_image.width = width;
-        raw_image.height = height;
-        raw_image.data_type = dt;
-        raw_image.len = static_cast<uint32_t>(raw_data.size());
+      if (gago::LercUtil::ReadTiffOrDie(input_path, &raw_image.width, &raw_image.height, &dims,
+                                        &raw_image.data_type, &raw_image.raw_data)) {
+        raw_image.len = raw_image.raw_data.size();
         raw_image.band = band;
-        raw_image.raw_data = raw_data;
         
         write_raw_data_to_file(raw_image, output_path);
+      } else {
+        count_result(ENCODE_FAILED);
       }
     } else {
-      gago::LercUtil::EncodeTiffOrDie(input_path,
-                                      output_path,
-                                      max_z_error,
-                                      gago::LercUtil::LercVersion::V2_3,
-                                      band);
+      count_result(encode_tiff(input_path, output_path, max_z_error, band, target_size, target_bpp,
+                               max_blob_bytes));
     }
   }
   
+  if (num_failed > 0 || num_missed > 0) {
+    gago::Logger::LogD("%zu failed, %zu over target size", num_failed, num_missed);
+    return EXIT_FAILURE;
+  }
+  
   gago::Logger::LogD("DONE");
 
   return EXIT_SUCCESS;